@@ -14,6 +14,7 @@ cmake_configure_args=( -DCMAKE_EXPORT_COMPILE_COMMANDS=True )
 
 BITS32=
 BITS64=
+AMD64=
 
 if [[ ! $FIBER_CROSS ]]; then
 
@@ -29,7 +30,7 @@ if [[ ! $FIBER_CROSS ]]; then
     esac
 
     case "$(uname -m)" in
-        amd64|x86_64) BITS64=1  ;;
+        amd64|x86_64) BITS64=1; AMD64=1 ;;
         aarch64) BITS64=1 ;;
         arm*) BITS32=1 ;;
     esac
@@ -78,8 +79,10 @@ compiler_supports_m32() {
 
 build_configs=( )
 
+# variants: unchecked, checked (FIBER_ASM_CHECK_ALIGNMENT), stats (checked +
+# FIBER_STATS), compact (checked + FIBER_COMPACT_REGS)
 add_build_config() {
-    local bt="$1" cc="$2" bits="$3" link_mode="$4" check_align="$5"
+    local bt="$1" cc="$2" bits="$3" link_mode="$4" variant="$5"
     local cm_flags=( -DCMAKE_BUILD_TYPE="${bt^^}" )
 
     if [[ $FIBER_CROSS ]]; then
@@ -99,17 +102,26 @@ add_build_config() {
         cm_flags+=( -DFIBER_SHARED=False )
     fi
 
-    if [[ $check_align = "checked" ]]; then
-        cm_flags+=( -DFIBER_ASM_CHECK_ALIGNMENT=True )
-    else
+    if [[ $variant = "unchecked" ]]; then
         cm_flags+=( -DFIBER_ASM_CHECK_ALIGNMENT=False )
+    else
+        cm_flags+=( -DFIBER_ASM_CHECK_ALIGNMENT=True )
+    fi
+
+    [[ $variant = "stats" ]] && cm_flags+=( -DFIBER_STATS=True )
+
+    if [[ $variant = "compact" ]]; then
+        # only implemented for amd64 SysV
+        [[ $AMD64 && $bits = 64 && ! $SYS_WINDOWS && ! $FIBER_CROSS ]] ||
+            return
+        cm_flags+=( -DFIBER_COMPACT_REGS=True )
     fi
 
     local conf_name
     if [[ $FIBER_CROSS ]]; then
-        conf_name="$FIBER_CROSS-${bt}-${link_mode}-${check_align}"
+        conf_name="$FIBER_CROSS-${bt}-${link_mode}-${variant}"
     else
-        conf_name="${bt}-${cc}${bits}-${link_mode}-${check_align}"
+        conf_name="${bt}-${cc}${bits}-${link_mode}-${variant}"
     fi
     eval "export cmake_flags_${conf_name//-/_}=\"${cm_flags[*]}\""
     build_configs+=( "$conf_name" )
@@ -125,8 +137,8 @@ init_configs() {
             fi
             for bt in "${build_types[@]}"; do
                 for link_mode in "${link_modes[@]}"; do
-                    for ca in "unchecked" "checked"; do
-                        add_build_config "$bt" "$cc" "$bits" "$link_mode" "$ca"
+                    for v in "unchecked" "checked" "stats" "compact"; do
+                        add_build_config "$bt" "$cc" "$bits" "$link_mode" "$v"
                     done
                 done
             done
@@ -50,12 +50,15 @@ typedef struct Fiber
 #define FIBER_FS_ALIVE FIBER_STATE_CONSTANT(4)
 #define FIBER_FS_HAS_LO_GUARD_PAGE FIBER_STATE_CONSTANT(8)
 #define FIBER_FS_HAS_HI_GUARD_PAGE FIBER_STATE_CONSTANT(16)
+#define FIBER_FS_HAS_CANARY FIBER_STATE_CONSTANT(32)
 
 #define FIBER_FLAG_GUARD_LO FIBER_FLAG_CONSTANT(8)
 #define FIBER_FLAG_GUARD_HI FIBER_FLAG_CONSTANT(16)
+#define FIBER_FLAG_GUARD_CANARY FIBER_FLAG_CONSTANT(32)
 
 typedef void(FIBER_CCONV *FiberFunc)(void *);
 typedef void(FIBER_CCONV *FiberCleanupFunc)(Fiber *, void *);
+typedef void(FIBER_CCONV *FiberReleaseFunc)(Fiber *, void *);
 
 /**
  * initialize a Fiber with a preallocated stack. Stack alignment will be
@@ -93,11 +96,17 @@ fiber_init_toplevel(HU_OUT_NONNULL Fiber *fbr);
 /**
  * create a new Fiber by allocating a fresh stack, optionally with bottom or top
  * guard frames (each page usually adds an overhead of 4kb). It is recommended
- * to pass FIBER_FLAG_GUARD_LO, to catch stack overflows. @see fiber_init()
+ * to pass FIBER_FLAG_GUARD_LO, to catch stack overflows. Each guard page costs
+ * a separate memory mapping, if that is too expensive pass
+ * FIBER_FLAG_GUARD_CANARY instead: canary words are placed at the bottom of
+ * the stack and checked every time the fiber is switched away from, the
+ * program is aborted if they were overwritten. @see fiber_init()
  * @param fbr the fiber to create
  * @param stack_size size of stack
  * @param cleanup the initial function on the call stack.
  * @param arg the arg to pass to cleanup when it is invoked
+ * @return false if the stack could not be allocated, or if it is too small
+ * to hold the canary and the initial frame
  */
 HU_NODISCARD
 FIBER_API
@@ -118,6 +127,91 @@ HU_NONNULL_PARAMS(1)
 void
 fiber_destroy(HU_IN_NONNULL Fiber *fbr);
 
+/**
+ * A FiberPool caches the stacks of released fibers, so that creating a fiber
+ * does not have to allocate a fresh stack (and protect its guard pages). All
+ * stacks of a pool have the same size and guard flags. A pool is not thread
+ * safe, use one pool per OS thread.
+ */
+typedef struct FiberPool
+{
+    void *free_stacks;
+    size_t stack_size;
+    size_t num_free;
+    size_t max_free;
+    FiberFlags flags;
+} FiberPool;
+
+/**
+ * initialize an empty FiberPool.
+ * @param pool the pool to initialize
+ * @param stack_size size of the stacks handed out by the pool
+ * @param flags guard flags for the stacks, @see fiber_alloc()
+ * @param max_free maximum number of unused stacks to keep cached
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+void
+fiber_pool_init(HU_OUT_NONNULL FiberPool *pool,
+                size_t stack_size,
+                FiberFlags flags,
+                size_t max_free);
+
+/**
+ * Release all cached stacks. Fibers still allocated from the pool are not
+ * affected and have to be destroyed with fiber_destroy().
+ * @param pool the pool to destroy
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+void
+fiber_pool_destroy(HU_INOUT_NONNULL FiberPool *pool);
+
+/**
+ * create a new Fiber like fiber_alloc(), but reuse a cached stack if the pool
+ * has one.
+ * @param pool pool to take the stack from
+ * @param fbr the fiber to create
+ * @param cleanup the initial function on the call stack.
+ * @param arg the arg to pass to cleanup when it is invoked
+ */
+HU_NODISCARD
+FIBER_API
+HU_NONNULL_PARAMS(1, 2, 3)
+bool
+fiber_pool_alloc(HU_INOUT_NONNULL FiberPool *pool,
+                 HU_OUT_NONNULL Fiber *fbr,
+                 HU_IN_NONNULL FiberCleanupFunc cleanup,
+                 void *arg);
+
+/**
+ * Give the stack of a fiber back to the pool, or deallocate it if the pool is
+ * full. The fiber has to be allocated by fiber_pool_alloc() from the same
+ * pool, or by fiber_alloc() with the same stack size and flags.
+ * @param pool pool to return the stack to
+ * @param fbr the fiber to destroy
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1, 2)
+void
+fiber_pool_release(HU_INOUT_NONNULL FiberPool *pool,
+                   HU_INOUT_NONNULL Fiber *fbr);
+
+/**
+ * Give the memory of the unused part of a suspended fiber's stack back to the
+ * OS, i.e. all whole pages between the bottom of the stack and the saved stack
+ * pointer. The pages stay mapped and are transparently faulted in again when
+ * the stack grows. Useful to shrink the stacks of fibers which are parked for a
+ * long time after a deep call chain. Nothing is discarded if the fiber is
+ * suspended on a different stack, @see fiber_call_with_stack().
+ * @param fbr the fiber whose stack to trim, cannot be executing
+ * @return false if the OS refused to release the pages
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+bool
+fiber_trim_stack(HU_INOUT_NONNULL Fiber *fbr);
+
 /**
  * Switch from the current fiber to a different fiber by returning to the stack
  * frame of the new fiber. from has to be the active fiber!
@@ -129,6 +223,83 @@ HU_NONNULL_PARAMS(1, 2)
 void
 fiber_switch(HU_INOUT_NONNULL Fiber *from, HU_INOUT_NONNULL Fiber *to);
 
+/**
+ * Switch from the current fiber to a different fiber for the last time and
+ * release the stack of the current fiber. release is called after the stack
+ * of from has been left, it runs on the stack of to right before to resumes.
+ * Typically it calls fiber_destroy() or fiber_pool_release() on from, it may
+ * also free the memory of the Fiber struct itself. release must return
+ * normally and must not switch fibers.
+ * @param from currently executing fiber, it is not executing anymore when
+ * release is called
+ * @param to fiber to switch to
+ * @param release function to release the stack of from
+ * @param arg the argument to pass to release
+ */
+HU_NORETURN
+FIBER_API
+HU_NONNULL_PARAMS(1, 2, 3)
+void
+fiber_switch_release(HU_INOUT_NONNULL Fiber *from,
+                     HU_INOUT_NONNULL Fiber *to,
+                     HU_IN_NONNULL FiberReleaseFunc release,
+                     void *arg);
+
+/**
+ * A copy of the live part of a suspended fiber's stack together with its
+ * registers. Stack frames contain absolute addresses, so a snapshot can only
+ * be restored into the fiber (or rather the stack) it was taken from.
+ */
+typedef struct FiberSnapshot
+{
+    FiberRegs regs;
+    void *stack;
+    size_t stack_size;
+    void *data;
+    size_t data_size;
+    FiberState state;
+} FiberSnapshot;
+
+/**
+ * Save the state of a suspended fiber, i.e. its registers and the used part
+ * of its stack (everything above the saved stack pointer). Together with
+ * fiber_restore() this allows to resume a fiber from the same point more than
+ * once, e.g. for backtracking search.
+ * @param fbr the fiber to save, cannot be executing
+ * @param snap receives the snapshot, release it with fiber_snapshot_free()
+ * @return false if the memory for the snapshot could not be allocated, or if
+ * the fiber is suspended on a different stack, @see fiber_call_with_stack()
+ */
+HU_NODISCARD
+FIBER_API
+HU_NONNULL_PARAMS(1, 2)
+bool
+fiber_snapshot(HU_IN_NONNULL const Fiber *fbr,
+               HU_OUT_NONNULL FiberSnapshot *snap);
+
+/**
+ * Reset a suspended fiber to a state previously saved by fiber_snapshot(). The
+ * saved stack contents are copied back to the same addresses, the current
+ * contents of the stack are lost. Memory outside of the stack, e.g. on the
+ * heap, is not affected.
+ * @param fbr the fiber the snapshot was taken from, cannot be executing
+ * @param snap the snapshot to restore, can be restored any number of times
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1, 2)
+void
+fiber_restore(HU_INOUT_NONNULL Fiber *fbr,
+              HU_IN_NONNULL const FiberSnapshot *snap);
+
+/**
+ * Deallocate the memory of a snapshot.
+ * @param snap the snapshot to free
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+void
+fiber_snapshot_free(HU_INOUT_NONNULL FiberSnapshot *snap);
+
 /**
  * Allocate a fresh stack frame at the top of a fiber with an argument buffer of
  * args_size. If the fiber is switched to it will execute the function.
@@ -185,6 +356,167 @@ fiber_exec_on(HU_IN_NONNULL Fiber *active,
               HU_IN_NONNULL FiberFunc f,
               void *args);
 
+#define FIBER_ARENA_ALIGNMENT ((size_t) 16)
+
+typedef struct FiberArenaChunk FiberArenaChunk;
+
+/**
+ * A FiberArena is a bump pointer allocator for memory whose lifetime ends
+ * together with a fiber. The first block of memory is supplied by the caller,
+ * a good place is the argument buffer of the fiber's entry frame (see
+ * fiber_reserve_return()): it lives at the top of the fiber stack and goes
+ * away together with it. If the arena runs out of space, additional chunks
+ * are allocated with malloc() and chained together. Individual allocations
+ * cannot be freed, fiber_arena_reset() releases everything at once. A
+ * FiberArena is not thread safe.
+ *
+ * The arena is managed by the caller, it is not attached to the fiber:
+ * fiber_destroy(), fiber_pool_release() and fiber_switch_release() do not
+ * know about it. Call fiber_arena_reset() on every exit path of the fiber,
+ * e.g. in the release function passed to fiber_switch_release(), otherwise
+ * the overflow chunks leak.
+ */
+typedef struct FiberArena
+{
+    char *cur;
+    char *end;
+    void *buf;
+    size_t buf_size;
+    size_t chunk_size;
+    FiberArenaChunk *chunks;
+} FiberArena;
+
+/**
+ * initialize a FiberArena.
+ * @param arena the arena to initialize
+ * @param buf initial memory block, may be NULL if size is 0
+ * @param size size of the initial memory block
+ * @param chunk_size minimum size of overflow chunks
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+void
+fiber_arena_init(HU_OUT_NONNULL FiberArena *arena,
+                 void *buf,
+                 size_t size,
+                 size_t chunk_size);
+
+/**
+ * Release all overflow chunks and make the whole initial memory block
+ * available again. Has to be called before the arena goes out of scope,
+ * unless it never overflowed. The chunks are freed one by one, so the cost
+ * is linear in their number, the initial memory block is not accessed.
+ * @param arena the arena to reset
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+void
+fiber_arena_reset(HU_INOUT_NONNULL FiberArena *arena);
+
+/**
+ * slow path of fiber_arena_alloc(), allocates a new chunk.
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+void *
+fiber_arena_alloc_chunk(HU_INOUT_NONNULL FiberArena *arena, size_t size);
+
+/**
+ * Allocate size bytes from an arena, aligned to FIBER_ARENA_ALIGNMENT.
+ * @param arena the arena to allocate from
+ * @param size number of bytes to allocate
+ * @return pointer to the allocated memory, or NULL if malloc() failed
+ */
+HU_WARN_UNUSED
+HU_NONNULL_PARAMS(1)
+static inline void *
+fiber_arena_alloc(HU_INOUT_NONNULL FiberArena *arena, size_t size)
+{
+    uintptr_t p = (hu_cxx_reinterpret_cast(uintptr_t, arena->cur) +
+                   (FIBER_ARENA_ALIGNMENT - 1)) &
+                  ~hu_static_cast(uintptr_t, FIBER_ARENA_ALIGNMENT - 1);
+    uintptr_t end = hu_cxx_reinterpret_cast(uintptr_t, arena->end);
+    if (hu_likely(arena->cur && p <= end && size <= end - p)) {
+        arena->cur = hu_cxx_reinterpret_cast(char *, p + size);
+        return hu_cxx_reinterpret_cast(void *, p);
+    }
+    return fiber_arena_alloc_chunk(arena, size);
+}
+
+/**
+ * Resource usage counters, @see fiber_stats(). Except for thread_switches,
+ * all counters are process wide and can be read from any thread.
+ */
+typedef struct FiberStats
+{
+    /** fibers with a stack allocated by fiber_alloc() or a FiberPool */
+    size_t live_fibers;
+    /** bytes of stack memory (including guard pages and stacks cached in
+     * pools), the memory actually committed by the OS might be less */
+    size_t stack_bytes;
+    /** guard pages, each guard page splits the mapping of its stack */
+    size_t guard_pages;
+    /** total number of stack allocations */
+    size_t stack_allocs;
+    /** total number of fiber_pool_alloc() calls served from the pool */
+    size_t pool_hits;
+    /** total number of fiber_pool_alloc() calls which allocated a stack */
+    size_t pool_misses;
+    /** total number of fiber switches, summed over the per thread counters of
+     * all threads (including threads which already exited) */
+    size_t switches;
+    /** total number of fiber switches done by the calling thread */
+    size_t thread_switches;
+} FiberStats;
+
+/**
+ * Take a snapshot of the resource usage counters. The counters are only
+ * maintained if the library was built with FIBER_STATS. The first fiber switch
+ * of each OS thread allocates a small counter, which is kept until the process
+ * exits and is visited by every call to fiber_stats(). In a process which keeps
+ * creating threads the memory used by the counters and the cost of
+ * fiber_stats() grow with the number of threads which ever switched fibers.
+ * @param stats receives the counters, zeroed if FIBER_STATS is disabled
+ * @return false if the library was built without FIBER_STATS
+ */
+FIBER_API
+HU_NONNULL_PARAMS(1)
+bool
+fiber_stats(HU_OUT_NONNULL FiberStats *stats);
+
+/**
+ * Call a function on a temporary stack of at least min_size bytes. Unlike
+ * fiber_exec_on() no fiber has to be provided: the stack is taken from a
+ * small per OS thread cache, or freshly allocated with a guard page at its
+ * bottom. After f returns the stack is put back into the cache. Useful for
+ * occasional deep calls from fibers with small stacks. Nested calls are
+ * allowed and use different stacks, f may also switch fibers. While the
+ * calling fiber is suspended inside f its saved stack pointer lies on the
+ * temporary stack: fiber_trim_stack() discards nothing,
+ * fiber_stack_free_size() reports 0, fiber_snapshot() fails, and frames
+ * pushed with fiber_reserve_return() are placed on the temporary stack. The
+ * temporary stack is only put back into the cache when f returns: if the
+ * calling fiber is destroyed while suspended inside f, the stack leaks, it is
+ * not reachable by fiber_release_call_stacks().
+ * @param min_size minimum number of bytes of the temporary stack
+ * @param f function to call
+ * @param args argument to pass to f
+ * @return false if no stack could be allocated, f was not called
+ */
+HU_NODISCARD
+FIBER_API
+HU_NONNULL_PARAMS(2)
+bool
+fiber_call_with_stack(size_t min_size, HU_IN_NONNULL FiberFunc f, void *args);
+
+/**
+ * Deallocate the stacks cached by fiber_call_with_stack() for the calling OS
+ * thread, should be called before the thread exits.
+ */
+FIBER_API
+void
+fiber_release_call_stacks(void);
+
 /**
  * @return The compiled in stack alignment
  */
@@ -246,8 +578,12 @@ HU_NONNULL_PARAMS(1)
 static inline size_t
 fiber_stack_free_size(HU_IN_NONNULL const Fiber *fbr)
 {
-    return hu_static_cast(char *, fbr->regs.sp) -
-           hu_static_cast(char *, fbr->stack);
+    char *sp = hu_static_cast(char *, fbr->regs.sp);
+    char *stack = hu_static_cast(char *, fbr->stack);
+    /* suspended on a different stack, @see fiber_call_with_stack() */
+    if (sp < stack || sp > stack + fbr->stack_size)
+        return 0;
+    return hu_static_cast(size_t, sp - stack);
 }
 
 HU_WARN_UNUSED
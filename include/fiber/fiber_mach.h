@@ -32,15 +32,22 @@
 #elif HU_ARCH_X86_P && HU_BITS_64_P && HU_OS_POSIX_P
 #    define FIBER_TARGET_AMD64_SYSV
 #    define FIBER_STACK_ALIGNMENT 16
-#    define FIBER_ARCH_REGS                                                    \
-        void *sp;                                                              \
-        void *lr;                                                              \
-        void *rbp;                                                             \
-        void *rbx;                                                             \
-        void *r12;                                                             \
-        void *r13;                                                             \
-        void *r14;                                                             \
-        void *r15
+#    define FIBER_HAVE_COMPACT_REGS 1
+#    ifdef FIBER_COMPACT_REGS
+/* rbp, rbx, r12 - r15 and the return address are saved on the fiber stack */
+#        define FIBER_COMPACT_SAVED_REGS 6
+#        define FIBER_ARCH_REGS void *sp
+#    else
+#        define FIBER_ARCH_REGS                                                \
+            void *sp;                                                          \
+            void *lr;                                                          \
+            void *rbp;                                                         \
+            void *rbx;                                                         \
+            void *r12;                                                         \
+            void *r13;                                                         \
+            void *r14;                                                         \
+            void *r15
+#    endif
 
 #elif HU_ARCH_X86_P && HU_BITS_64_P && HU_OS_WINDOWS_P
 #    define FIBER_TARGET_AMD64_WIN64 1
@@ -127,6 +134,10 @@
 #    define FIBER_CCONV
 #endif
 
+#if defined(FIBER_COMPACT_REGS) && !defined(FIBER_HAVE_COMPACT_REGS)
+#    error "fiber: FIBER_COMPACT_REGS is not supported on this target"
+#endif
+
 #if HU_C_P || HU_CXX_P
 HU_BEGIN_EXTERN_C
 typedef struct FiberRegs
@@ -1,8 +1,13 @@
+#ifndef _DEFAULT_SOURCE
+#    define _DEFAULT_SOURCE 1 /* madvise() */
+#endif
+
 #include <fiber/fiber.h>
 
 #include "fiber_asm.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <hu/annotations.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,18 +44,143 @@ static const size_t STACK_ALIGNMENT = FIBER_STACK_ALIGNMENT;
 static const size_t ARG_ALIGNMENT = 8;
 static const size_t WORD_SIZE = sizeof(void *);
 
+#define CANARY_WORDS 4
+#define CANARY_SIZE (CANARY_WORDS * sizeof(uintptr_t))
+#define CANARY_VALUE ((uintptr_t) 0x5ca1ab1eC0ffee11ull)
+/* space a fresh frame needs above the canary, covers the words pushed by
+ * fiber_reserve_return() */
+#define CANARY_HEADROOM (CANARY_SIZE + 16 * sizeof(void *))
+
+#define GUARD_FLAGS                                                            \
+    (FIBER_FLAG_GUARD_LO | FIBER_FLAG_GUARD_HI | FIBER_FLAG_GUARD_CANARY)
+
 #if HU_HAVE_NONNULL_PARAMS_P || HU_HAVE_INOUT_NONNULL_P
 #    define NULL_CHECK(arg, msg)
 #else
 #    define NULL_CHECK(arg, msg) assert(arg &&msg)
 #endif
 
+#ifdef _MSC_VER
+#    define THREAD_LOCAL __declspec(thread)
+#else
+#    define THREAD_LOCAL __thread
+#endif
+
+#ifdef FIBER_STATS
+typedef struct
+{
+    size_t live_fibers;
+    size_t stack_bytes;
+    size_t guard_pages;
+    size_t stack_allocs;
+    size_t pool_hits;
+    size_t pool_misses;
+} GlobalStats;
+
+static GlobalStats global_stats;
+
+/* per thread switch counter, only written by its owning thread. Counters
+ * are registered on the first switch and never unlinked, so that
+ * fiber_stats() can sum them from any thread */
+typedef struct SwitchCounter
+{
+    struct SwitchCounter *next;
+    size_t switches;
+} SwitchCounter;
+
+static SwitchCounter *switch_counters;
+static THREAD_LOCAL SwitchCounter *thread_switches;
+
+#    if HU_COMP_GNUC_P
+#        define STATS_ADD(c, n)                                                \
+            ((void) __atomic_fetch_add(                                        \
+              &global_stats.c, (size_t) (n), __ATOMIC_RELAXED))
+#        define STATS_SUB(c, n)                                                \
+            ((void) __atomic_fetch_sub(                                        \
+              &global_stats.c, (size_t) (n), __ATOMIC_RELAXED))
+#        define STATS_LOAD(c) __atomic_load_n(&global_stats.c, __ATOMIC_RELAXED)
+#        define ATOMIC_LOAD_SIZE(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#        define ATOMIC_STORE_SIZE(p, v)                                        \
+            __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#        define ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#        define ATOMIC_CAS_PTR(p, old, new)                                    \
+            __atomic_compare_exchange_n(                                       \
+              (p), &(old), (new), false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)
+#    elif defined(_MSC_VER) && HU_BITS_64_P
+#        define STATS_ADD(c, n)                                                \
+            ((void) InterlockedExchangeAdd64(                                  \
+              (volatile LONG64 *) &global_stats.c, (LONG64) (n)))
+#        define STATS_SUB(c, n)                                                \
+            ((void) InterlockedExchangeAdd64(                                  \
+              (volatile LONG64 *) &global_stats.c, -(LONG64) (n)))
+#        define STATS_LOAD(c) (*(volatile size_t *) &global_stats.c)
+#        define ATOMIC_LOAD_SIZE(p) (*(volatile size_t *) (p))
+#        define ATOMIC_STORE_SIZE(p, v) (*(volatile size_t *) (p) = (v))
+#        define ATOMIC_LOAD_PTR(p) (*(void *volatile *) (p))
+#        define ATOMIC_CAS_PTR(p, old, new)                                    \
+            (InterlockedCompareExchangePointer(                                \
+               (PVOID volatile *) (p), (new), (old)) == (old))
+#    elif defined(_MSC_VER)
+#        define STATS_ADD(c, n)                                                \
+            ((void) InterlockedExchangeAdd((volatile LONG *) &global_stats.c,  \
+                                           (LONG) (n)))
+#        define STATS_SUB(c, n)                                                \
+            ((void) InterlockedExchangeAdd((volatile LONG *) &global_stats.c,  \
+                                           -(LONG) (n)))
+#        define STATS_LOAD(c) (*(volatile size_t *) &global_stats.c)
+#        define ATOMIC_LOAD_SIZE(p) (*(volatile size_t *) (p))
+#        define ATOMIC_STORE_SIZE(p, v) (*(volatile size_t *) (p) = (v))
+#        define ATOMIC_LOAD_PTR(p) (*(void *volatile *) (p))
+#        define ATOMIC_CAS_PTR(p, old, new)                                    \
+            (InterlockedCompareExchangePointer(                                \
+               (PVOID volatile *) (p), (new), (old)) == (old))
+#    else
+#        error "FIBER_STATS: no atomics available for this compiler"
+#    endif
+#    define STATS_COUNT_SWITCH() count_switch()
+#else
+#    define STATS_ADD(c, n) ((void) (n))
+#    define STATS_SUB(c, n) ((void) (n))
+#    define STATS_COUNT_SWITCH() ((void) 0)
+#endif
+
 #define error_abort(msg)                                                       \
     do {                                                                       \
         fprintf(stderr, "%s\n", msg);                                          \
         abort();                                                               \
     } while (0)
 
+#ifdef FIBER_STATS
+static HU_NOINLINE SwitchCounter *
+register_switch_counter(void)
+{
+    SwitchCounter *counter =
+      (SwitchCounter *) calloc(1, sizeof(SwitchCounter));
+    if (hu_unlikely(!counter))
+        return NULL;
+    SwitchCounter *head;
+    /* reload on every attempt, ATOMIC_CAS_PTR() does not update head on
+     * failure with every compiler */
+    do {
+        head = (SwitchCounter *) ATOMIC_LOAD_PTR(&switch_counters);
+        counter->next = head;
+    } while (!ATOMIC_CAS_PTR(&switch_counters, head, counter));
+    return counter;
+}
+
+static inline void
+count_switch(void)
+{
+    SwitchCounter *counter = thread_switches;
+    if (hu_unlikely(!counter)) {
+        counter = thread_switches = register_switch_counter();
+        if (!counter)
+            return;
+    }
+    ATOMIC_STORE_SIZE(&counter->switches, counter->switches + 1);
+}
+#endif
+
 static inline char *
 stack_align_n(char *sp, size_t n)
 {
@@ -64,6 +194,13 @@ is_stack_aligned(void *sp)
     return ((uintptr_t) sp & (STACK_ALIGNMENT - 1)) == 0;
 }
 
+/* aligned start of the unused stack area below a suspended fiber's frames */
+static inline void *
+free_stack_top(const Fiber *fbr)
+{
+    return stack_align_n((char *) fbr->regs.sp, STACK_ALIGNMENT);
+}
+
 static inline void
 push(char **sp, void *val)
 {
@@ -82,9 +219,47 @@ HU_NORETURN
 static void
 fiber_guard(void *fbr);
 
+/* mix in the address, so that a stack copied over the canary is noticed */
+static inline uintptr_t
+canary_word(const uintptr_t *p)
+{
+    return CANARY_VALUE ^ (uintptr_t) p;
+}
+
+static void
+write_canary(Fiber *fbr)
+{
+    uintptr_t *p = (uintptr_t *) fbr->stack;
+    for (size_t i = 0; i < CANARY_WORDS; ++i)
+        p[i] = canary_word(p + i);
+}
+
+static void
+check_canary(const Fiber *fbr)
+{
+    const uintptr_t *p = (const uintptr_t *) fbr->stack;
+    for (size_t i = 0; i < CANARY_WORDS; ++i)
+        if (hu_unlikely(p[i] != canary_word(p + i)))
+            error_abort("ERROR: fiber stack overflow, canary overwritten");
+}
+
+/* smallest stack fiber_init_() can set up a canary-guarded fiber on: worst
+ * case alignment of the top, the frame of fiber_guard() and the headroom
+ * checked by fiber_reserve_return() */
+static size_t
+canary_min_stack_size(void)
+{
+    size_t arg_align =
+      ARG_ALIGNMENT > STACK_ALIGNMENT ? ARG_ALIGNMENT : STACK_ALIGNMENT;
+    return WORD_SIZE + (STACK_ALIGNMENT - 1) + sizeof(FiberGuardArgs) +
+           (arg_align - 1) + CANARY_HEADROOM;
+}
+
 static void
 fiber_init_(Fiber *fbr, FiberCleanupFunc cleanup, void *arg)
 {
+    if (fbr->state & FIBER_FS_HAS_CANARY)
+        write_canary(fbr);
     memset(&fbr->regs, 0, sizeof fbr->regs);
     uintptr_t sp =
       (uintptr_t) ((char *) fbr->stack + fbr->stack_size - WORD_SIZE);
@@ -182,6 +357,32 @@ protect_page(void *p, bool rw)
 #endif
 }
 
+static bool
+discard_pages(void *p, size_t sz)
+{
+#if HU_OS_POSIX_P
+#    ifdef MADV_FREE
+    if (madvise(p, sz, MADV_FREE) == 0)
+        return true;
+    /* only fall back if MADV_FREE is not supported by the kernel, the
+     * destructive MADV_DONTNEED must never be applied to a bogus range */
+    if (errno != EINVAL)
+        return false;
+#    endif
+#    ifdef MADV_DONTNEED
+    return madvise(p, sz, MADV_DONTNEED) == 0;
+#    else
+    (void) p;
+    (void) sz;
+    return false;
+#    endif
+#elif HU_OS_WINDOWS_P
+    return VirtualAlloc(p, sz, MEM_RESET, PAGE_READWRITE) != NULL;
+#else
+#    error "BUG: platform not properly handled"
+#endif
+}
+
 bool
 fiber_alloc(Fiber *fbr,
             size_t size,
@@ -190,14 +391,19 @@ fiber_alloc(Fiber *fbr,
             FiberFlags flags)
 {
     NULL_CHECK(fbr, "Fiber cannot be NULL");
-    flags &= FIBER_FLAG_GUARD_LO | FIBER_FLAG_GUARD_HI;
+    flags &= GUARD_FLAGS;
     fbr->stack_size = size;
     const size_t stack_size = size;
 
-    if (!flags) {
+    if ((flags & FIBER_FLAG_GUARD_CANARY) &&
+        hu_unlikely(size < canary_min_stack_size()))
+        return false;
+
+    if (!(flags & (FIBER_FLAG_GUARD_LO | FIBER_FLAG_GUARD_HI))) {
         fbr->alloc_stack = fbr->stack = malloc(stack_size);
         if (!fbr->alloc_stack)
             return false;
+        STATS_ADD(stack_bytes, stack_size);
     } else {
         size_t pgsz = get_page_size();
         size_t npages = (size + pgsz - 1) / pgsz;
@@ -221,8 +427,14 @@ fiber_alloc(Fiber *fbr,
             fbr->stack = (char *) fbr->alloc_stack + pgsz;
         else
             fbr->stack = fbr->alloc_stack;
+        STATS_ADD(stack_bytes, npages * pgsz);
+        STATS_ADD(guard_pages,
+                  !!(flags & FIBER_FLAG_GUARD_LO) +
+                    !!(flags & FIBER_FLAG_GUARD_HI));
     }
 
+    STATS_ADD(stack_allocs, 1);
+    STATS_ADD(live_fibers, 1);
     fbr->state = flags;
     fiber_init_(fbr, cleanup, arg);
     return true;
@@ -232,39 +444,175 @@ fail:
     return false;
 }
 
-void
-fiber_destroy(Fiber *fbr)
+static void
+free_stack(void *alloc_stack, size_t stack_size, FiberState state)
 {
-    assert(!fiber_is_executing(fbr));
-    assert(!fiber_is_toplevel(fbr));
-
-    if (!fbr->alloc_stack)
-        return;
-
-    if (fbr->state &
-        (FIBER_FS_HAS_HI_GUARD_PAGE | FIBER_FS_HAS_LO_GUARD_PAGE)) {
+    if (state & (FIBER_FS_HAS_HI_GUARD_PAGE | FIBER_FS_HAS_LO_GUARD_PAGE)) {
         size_t pgsz = get_page_size();
-        size_t npages = (fbr->stack_size + pgsz - 1) / pgsz;
-        if (fbr->state & FIBER_FS_HAS_LO_GUARD_PAGE) {
+        size_t npages = (stack_size + pgsz - 1) / pgsz;
+        if (state & FIBER_FS_HAS_LO_GUARD_PAGE) {
             ++npages;
-            protect_page(fbr->alloc_stack, true);
+            protect_page(alloc_stack, true);
         }
 
-        if (fbr->state & FIBER_FS_HAS_HI_GUARD_PAGE) {
-            protect_page((char *) fbr->alloc_stack + npages * pgsz, true);
+        if (state & FIBER_FS_HAS_HI_GUARD_PAGE) {
+            protect_page((char *) alloc_stack + npages * pgsz, true);
+            ++npages;
         }
 
-        free_pages(fbr->alloc_stack);
+        free_pages(alloc_stack);
+        STATS_SUB(stack_bytes, npages * pgsz);
+        STATS_SUB(guard_pages,
+                  !!(state & FIBER_FS_HAS_LO_GUARD_PAGE) +
+                    !!(state & FIBER_FS_HAS_HI_GUARD_PAGE));
     } else {
-        free(fbr->alloc_stack);
+        free(alloc_stack);
+        STATS_SUB(stack_bytes, stack_size);
     }
+}
+
+/* false if the saved stack pointer is not on the fiber's own stack, e.g.
+ * because the fiber is suspended inside fiber_call_with_stack() */
+static inline bool
+sp_on_own_stack(const Fiber *fbr)
+{
+    char *sp = (char *) fbr->regs.sp;
+    return sp >= (char *) fbr->stack &&
+           sp <= (char *) fbr->stack + fbr->stack_size;
+}
 
+static void
+fiber_clear_stack(Fiber *fbr)
+{
     fbr->stack = NULL;
     fbr->stack_size = 0;
     fbr->regs.sp = NULL;
     fbr->alloc_stack = NULL;
 }
 
+void
+fiber_destroy(Fiber *fbr)
+{
+    assert(!fiber_is_executing(fbr));
+    assert(!fiber_is_toplevel(fbr));
+
+    if (!fbr->alloc_stack)
+        return;
+
+    free_stack(fbr->alloc_stack, fbr->stack_size, fbr->state);
+    fiber_clear_stack(fbr);
+    STATS_SUB(live_fibers, 1);
+}
+
+bool
+fiber_trim_stack(Fiber *fbr)
+{
+    NULL_CHECK(fbr, "Fiber cannot be NULL");
+    assert(!fiber_is_executing(fbr));
+    assert(!fiber_is_toplevel(fbr));
+
+    /* the part of the stack in use is unknown, nothing can be discarded */
+    if (!sp_on_own_stack(fbr))
+        return true;
+
+    size_t pgsz = get_page_size();
+    uintptr_t mask = ~(uintptr_t) (pgsz - 1);
+    uintptr_t lo = (uintptr_t) fbr->stack;
+    if (fbr->state & FIBER_FS_HAS_CANARY)
+        lo += CANARY_SIZE;
+    lo = (lo + pgsz - 1) & mask;
+    uintptr_t hi = (uintptr_t) fbr->regs.sp & mask;
+    if (hi <= lo)
+        return true;
+    return discard_pages((void *) lo, hi - lo);
+}
+
+/* a cached stack, stored at the lowest address of the usable stack area */
+typedef struct PoolStack
+{
+    struct PoolStack *next;
+    void *alloc_stack;
+} PoolStack;
+
+void
+fiber_pool_init(FiberPool *pool,
+                size_t stack_size,
+                FiberFlags flags,
+                size_t max_free)
+{
+    NULL_CHECK(pool, "FiberPool cannot be NULL");
+    pool->free_stacks = NULL;
+    pool->stack_size = stack_size;
+    pool->num_free = 0;
+    pool->max_free = max_free;
+    pool->flags = flags & GUARD_FLAGS;
+}
+
+void
+fiber_pool_destroy(FiberPool *pool)
+{
+    NULL_CHECK(pool, "FiberPool cannot be NULL");
+    PoolStack *ps = (PoolStack *) pool->free_stacks;
+    while (ps) {
+        PoolStack *next = ps->next;
+        free_stack(ps->alloc_stack, pool->stack_size, pool->flags);
+        ps = next;
+    }
+    pool->free_stacks = NULL;
+    pool->num_free = 0;
+}
+
+bool
+fiber_pool_alloc(FiberPool *pool,
+                 Fiber *fbr,
+                 FiberCleanupFunc cleanup,
+                 void *arg)
+{
+    NULL_CHECK(pool, "FiberPool cannot be NULL");
+    NULL_CHECK(fbr, "Fiber cannot be NULL");
+    PoolStack *ps = (PoolStack *) pool->free_stacks;
+    if (!ps) {
+        STATS_ADD(pool_misses, 1);
+        return fiber_alloc(fbr, pool->stack_size, cleanup, arg, pool->flags);
+    }
+
+    STATS_ADD(pool_hits, 1);
+    STATS_ADD(live_fibers, 1);
+    pool->free_stacks = ps->next;
+    --pool->num_free;
+    fbr->alloc_stack = ps->alloc_stack;
+    fbr->stack = ps;
+    fbr->stack_size = pool->stack_size;
+    fbr->state = pool->flags;
+    fiber_init_(fbr, cleanup, arg);
+    return true;
+}
+
+void
+fiber_pool_release(FiberPool *pool, Fiber *fbr)
+{
+    NULL_CHECK(pool, "FiberPool cannot be NULL");
+    NULL_CHECK(fbr, "Fiber cannot be NULL");
+    assert(!fiber_is_executing(fbr));
+    assert(!fiber_is_toplevel(fbr));
+    assert(fbr->alloc_stack);
+    assert(fbr->stack_size == pool->stack_size);
+    assert((fbr->state & GUARD_FLAGS) == pool->flags);
+
+    if (pool->num_free >= pool->max_free) {
+        fiber_destroy(fbr);
+        return;
+    }
+
+    PoolStack *ps = (PoolStack *) fbr->stack;
+    ps->next = (PoolStack *) pool->free_stacks;
+    ps->alloc_stack = fbr->alloc_stack;
+    pool->free_stacks = ps;
+    ++pool->num_free;
+    fiber_clear_stack(fbr);
+    STATS_SUB(live_fibers, 1);
+}
+
 void
 fiber_switch(Fiber *from, Fiber *to)
 {
@@ -277,11 +625,126 @@ fiber_switch(Fiber *from, Fiber *to)
     assert(fiber_is_executing(from));
     assert(!fiber_is_executing(to));
     assert(fiber_is_alive(to));
+    if (from->state & FIBER_FS_HAS_CANARY)
+        check_canary(from);
     from->state &= ~FIBER_FS_EXECUTING;
     to->state |= FIBER_FS_EXECUTING;
+    STATS_COUNT_SWITCH();
     fiber_asm_switch(&from->regs, &to->regs);
 }
 
+typedef struct
+{
+    Fiber *from;
+    Fiber *to;
+    FiberReleaseFunc release;
+    void *arg;
+} SwitchReleaseArgs;
+
+HU_NORETURN
+static void
+switch_release_cont(void *argsp)
+{
+    /* args still live on the stack which is about to be released */
+    SwitchReleaseArgs args = *(SwitchReleaseArgs *) argsp;
+    args.release(args.from, args.arg);
+    /* the registers of the released fiber are not needed anymore */
+    FiberRegs dead;
+    fiber_asm_switch(&dead, &args.to->regs);
+    error_abort("ERROR: released fiber was resumed");
+}
+
+void
+fiber_switch_release(Fiber *from,
+                     Fiber *to,
+                     FiberReleaseFunc release,
+                     void *arg)
+{
+    NULL_CHECK(from, "Fiber cannot be NULL");
+    NULL_CHECK(to, "Fiber cannot be NULL");
+    NULL_CHECK(release, "FiberReleaseFunc cannot be NULL");
+    assert(from != to);
+    assert(fiber_is_executing(from));
+    assert(!fiber_is_executing(to));
+    assert(fiber_is_alive(to));
+
+    if (from->state & FIBER_FS_HAS_CANARY)
+        check_canary(from);
+
+    SwitchReleaseArgs args;
+    args.from = from;
+    args.to = to;
+    args.release = release;
+    args.arg = arg;
+
+    from->state &= ~FIBER_FS_EXECUTING;
+    to->state |= FIBER_FS_EXECUTING;
+    STATS_COUNT_SWITCH();
+    /* the area below the saved stack pointer of to is unused, run release
+     * there, then jump into to without ever returning to this stack */
+    fiber_asm_exec_on_stack(&args, switch_release_cont, free_stack_top(to));
+    error_abort("ERROR: fiber_switch_release returned");
+}
+
+bool
+fiber_snapshot(const Fiber *fbr, FiberSnapshot *snap)
+{
+    NULL_CHECK(fbr, "Fiber cannot be NULL");
+    NULL_CHECK(snap, "FiberSnapshot cannot be NULL");
+    assert(!fiber_is_executing(fbr));
+    assert(!fiber_is_toplevel(fbr));
+
+    snap->data = NULL;
+    snap->data_size = 0;
+    /* frames on another stack, e.g. inside fiber_call_with_stack(), would
+     * not be captured */
+    if (hu_unlikely(!sp_on_own_stack(fbr)))
+        return false;
+
+    char *sp = (char *) fbr->regs.sp;
+    char *top = (char *) fbr->stack + fbr->stack_size;
+    snap->data_size = (size_t) (top - sp);
+    snap->data = malloc(snap->data_size ? snap->data_size : 1);
+    if (hu_unlikely(!snap->data))
+        return false;
+    memcpy(snap->data, sp, snap->data_size);
+    snap->regs = fbr->regs;
+    snap->stack = fbr->stack;
+    snap->stack_size = fbr->stack_size;
+    snap->state = fbr->state;
+    return true;
+}
+
+void
+fiber_restore(Fiber *fbr, const FiberSnapshot *snap)
+{
+    NULL_CHECK(fbr, "Fiber cannot be NULL");
+    NULL_CHECK(snap, "FiberSnapshot cannot be NULL");
+    assert(!fiber_is_executing(fbr));
+    assert(snap->data);
+
+    if (hu_unlikely(fbr->stack != snap->stack ||
+                    fbr->stack_size != snap->stack_size))
+        error_abort("ERROR: fiber_restore: snapshot of a different stack");
+
+    memcpy((char *) snap->stack + snap->stack_size - snap->data_size,
+           snap->data,
+           snap->data_size);
+    fbr->regs = snap->regs;
+    fbr->state =
+      (FiberState) ((fbr->state & ~FIBER_FS_ALIVE) |
+                    (snap->state & FIBER_FS_ALIVE));
+}
+
+void
+fiber_snapshot_free(FiberSnapshot *snap)
+{
+    NULL_CHECK(snap, "FiberSnapshot cannot be NULL");
+    free(snap->data);
+    snap->data = NULL;
+    snap->data_size = 0;
+}
+
 #if hu_has_attribute(weak)
 #    define HAVE_probe_stack_weak_dummy
 __attribute__((weak)) void
@@ -330,12 +793,31 @@ fiber_reserve_return(Fiber *fbr,
     sp = stack_align_n(sp - args_size, arg_align);
     *args_dest = sp;
 
+    /* the new frame must not run into the canary. If the fiber is suspended
+     * on a different stack, e.g. inside fiber_call_with_stack(), the frame is
+     * not placed on its own stack at all */
+    if ((fbr->state & FIBER_FS_HAS_CANARY) && sp_on_own_stack(fbr))
+        if (hu_unlikely(sp < (char *) fbr->stack + CANARY_HEADROOM))
+            error_abort("ERROR: fiber_reserve_return: stack overflow");
+
     size_t pgsz = get_page_size();
     if (hu_unlikely(args_size > pgsz - 100))
         probe_stack(sp, args_size, pgsz);
 
     assert(is_stack_aligned(sp));
 
+#ifdef FIBER_COMPACT_REGS
+    push(&sp, NULL); /* padding */
+    push(&sp, fbr->regs.sp);
+    push(&sp, hu_cxx_reinterpret_cast(void *, f));
+    push(&sp, *args_dest);
+    assert(is_stack_aligned(sp));
+
+    /* frame as left behind by fiber_asm_switch() */
+    push(&sp, hu_cxx_reinterpret_cast(void *, fiber_asm_invoke));
+    for (int i = 0; i < FIBER_COMPACT_SAVED_REGS; ++i)
+        push(&sp, NULL);
+#else
     push(&sp, fbr->regs.lr);
     push(&sp, fbr->regs.sp);
     push(&sp, hu_cxx_reinterpret_cast(void *, f));
@@ -344,6 +826,7 @@ fiber_reserve_return(Fiber *fbr,
     assert(is_stack_aligned(sp));
 
     fbr->regs.lr = hu_cxx_reinterpret_cast(void *, fiber_asm_invoke);
+#endif
 
     fbr->regs.sp = (void *) sp;
 }
@@ -361,12 +844,191 @@ fiber_exec_on(Fiber *active, Fiber *temp, FiberFunc f, void *args)
         assert(!fiber_is_executing(temp));
         temp->state |= FIBER_FS_EXECUTING;
         active->state &= ~FIBER_FS_EXECUTING;
-        fiber_asm_exec_on_stack(args, f, temp->regs.sp);
+        fiber_asm_exec_on_stack(args, f, free_stack_top(temp));
         active->state |= FIBER_FS_EXECUTING;
         temp->state &= ~FIBER_FS_EXECUTING;
     }
 }
 
+struct FiberArenaChunk
+{
+    FiberArenaChunk *next;
+};
+
+static const size_t ARENA_CHUNK_HEADER_SIZE =
+  (sizeof(FiberArenaChunk) + FIBER_ARENA_ALIGNMENT - 1) &
+  ~(FIBER_ARENA_ALIGNMENT - 1);
+
+void
+fiber_arena_init(FiberArena *arena, void *buf, size_t size, size_t chunk_size)
+{
+    NULL_CHECK(arena, "FiberArena cannot be NULL");
+    assert(buf || size == 0);
+    arena->cur = (char *) buf;
+    arena->end = buf ? (char *) buf + size : NULL;
+    arena->buf = buf;
+    arena->buf_size = size;
+    arena->chunk_size = chunk_size;
+    arena->chunks = NULL;
+}
+
+void
+fiber_arena_reset(FiberArena *arena)
+{
+    NULL_CHECK(arena, "FiberArena cannot be NULL");
+    FiberArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        FiberArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    fiber_arena_init(arena, arena->buf, arena->buf_size, arena->chunk_size);
+}
+
+void *
+fiber_arena_alloc_chunk(FiberArena *arena, size_t size)
+{
+    NULL_CHECK(arena, "FiberArena cannot be NULL");
+    /* leave room to align the first allocation, malloc() might only
+     * guarantee 8 byte alignment */
+    size_t sz = size + FIBER_ARENA_ALIGNMENT;
+    if (hu_unlikely(sz < size))
+        return NULL;
+    if (sz < arena->chunk_size)
+        sz = arena->chunk_size;
+    if (hu_unlikely(sz > (size_t) -1 - ARENA_CHUNK_HEADER_SIZE))
+        return NULL;
+
+    FiberArenaChunk *chunk =
+      (FiberArenaChunk *) malloc(ARENA_CHUNK_HEADER_SIZE + sz);
+    if (hu_unlikely(!chunk))
+        return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->cur = (char *) chunk + ARENA_CHUNK_HEADER_SIZE;
+    arena->end = arena->cur + sz;
+    return fiber_arena_alloc(arena, size);
+}
+
+bool
+fiber_stats(FiberStats *stats)
+{
+    NULL_CHECK(stats, "FiberStats cannot be NULL");
+    memset(stats, 0, sizeof *stats);
+#ifdef FIBER_STATS
+    stats->live_fibers = STATS_LOAD(live_fibers);
+    stats->stack_bytes = STATS_LOAD(stack_bytes);
+    stats->guard_pages = STATS_LOAD(guard_pages);
+    stats->stack_allocs = STATS_LOAD(stack_allocs);
+    stats->pool_hits = STATS_LOAD(pool_hits);
+    stats->pool_misses = STATS_LOAD(pool_misses);
+    for (SwitchCounter *counter =
+           (SwitchCounter *) ATOMIC_LOAD_PTR(&switch_counters);
+         counter;
+         counter = counter->next)
+        stats->switches += ATOMIC_LOAD_SIZE(&counter->switches);
+    if (thread_switches)
+        stats->thread_switches = thread_switches->switches;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* a stack for fiber_call_with_stack(), the header is stored at the top */
+typedef struct CallStack
+{
+    struct CallStack *next;
+    void *alloc_stack;
+    size_t size;
+} CallStack;
+
+#define MAX_CACHED_CALL_STACKS 4
+
+static THREAD_LOCAL CallStack *call_stacks;
+static THREAD_LOCAL size_t num_call_stacks;
+
+static CallStack *
+call_stack_alloc(size_t min_size)
+{
+    size_t pgsz = get_page_size();
+    /* room for the header, the rounding and the guard page */
+    if (hu_unlikely(min_size > (size_t) -1 - sizeof(CallStack) - 2 * pgsz))
+        return NULL;
+    size_t npages = (min_size + sizeof(CallStack) + pgsz - 1) / pgsz + 1;
+    char *alloc_stack = (char *) alloc_aligned_chunks(npages, pgsz);
+    if (hu_unlikely(!alloc_stack))
+        return NULL;
+    if (hu_unlikely(!protect_page(alloc_stack, false))) {
+        free_pages(alloc_stack);
+        return NULL;
+    }
+
+    CallStack *cs =
+      (CallStack *) (alloc_stack + npages * pgsz - sizeof(CallStack));
+    cs->next = NULL;
+    cs->alloc_stack = alloc_stack;
+    cs->size = (size_t) ((char *) cs - (alloc_stack + pgsz));
+    STATS_ADD(stack_bytes, npages * pgsz);
+    STATS_ADD(guard_pages, 1);
+    STATS_ADD(stack_allocs, 1);
+    return cs;
+}
+
+static void
+call_stack_free(CallStack *cs)
+{
+    size_t sz = (size_t) ((char *) (cs + 1) - (char *) cs->alloc_stack);
+    protect_page(cs->alloc_stack, true);
+    free_pages(cs->alloc_stack);
+    STATS_SUB(stack_bytes, sz);
+    STATS_SUB(guard_pages, 1);
+}
+
+bool
+fiber_call_with_stack(size_t min_size, FiberFunc f, void *args)
+{
+    NULL_CHECK(f, "FiberFunc cannot be NULL");
+    CallStack **link = &call_stacks;
+    while (*link && (*link)->size < min_size)
+        link = &(*link)->next;
+
+    CallStack *cs = *link;
+    if (cs) {
+        *link = cs->next;
+        --num_call_stacks;
+    } else {
+        cs = call_stack_alloc(min_size);
+        if (hu_unlikely(!cs))
+            return false;
+    }
+
+    fiber_asm_exec_on_stack(
+      args, f, stack_align_n((char *) cs, STACK_ALIGNMENT));
+
+    if (num_call_stacks < MAX_CACHED_CALL_STACKS) {
+        cs->next = call_stacks;
+        call_stacks = cs;
+        ++num_call_stacks;
+    } else {
+        call_stack_free(cs);
+    }
+    return true;
+}
+
+void
+fiber_release_call_stacks(void)
+{
+    CallStack *cs = call_stacks;
+    while (cs) {
+        CallStack *next = cs->next;
+        call_stack_free(cs);
+        cs = next;
+    }
+    call_stacks = NULL;
+    num_call_stacks = 0;
+}
+
 size_t
 fiber_stack_alignment()
 {
@@ -11,6 +11,8 @@ fiber_asm_switch(FiberRegs *from, FiberRegs *to);
  * followed by old sp
  * followed by pointer to args
  * followed by function to call
+ * With FIBER_COMPACT_REGS old sp points to the registers saved by
+ * fiber_asm_switch(), which are restored after the call.
  */
 extern void FIBER_CCONV
 fiber_asm_invoke(void);
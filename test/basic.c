@@ -6,6 +6,7 @@
 #include <string.h>
 
 #define STACK_SIZE ((size_t) 1024 * 16)
+#define ARENA_SIZE ((size_t) 256)
 
 static void
 fiber_cleanup(Fiber *fiber, void *args)
@@ -33,11 +34,247 @@ put_str(Fiber *active, Fiber *at, const char *arg)
     fiber_exec_on(active, at, run_put_str, (void *) arg);
 }
 
+static void
+test_arena(void *buf)
+{
+    FiberArena arena;
+    fiber_arena_init(&arena, buf, ARENA_SIZE, 512);
+    char *prev = NULL;
+    for (int i = 0; i < 100; ++i) {
+        char *p = (char *) fiber_arena_alloc(&arena, 24);
+        require(p);
+        require(((uintptr_t) p & (FIBER_ARENA_ALIGNMENT - 1)) == 0);
+        require(p != prev);
+        memset(p, i, 24);
+        prev = p;
+    }
+    require(arena.chunks);
+    require(fiber_arena_alloc(&arena, 4096));
+    fiber_arena_reset(&arena);
+    require(!arena.chunks);
+    require(fiber_arena_alloc(&arena, ARENA_SIZE / 2));
+}
+
+typedef struct
+{
+    int depth;
+    bool nested;
+} DeepCallArgs;
+
+static void
+deep_call(void *argsp)
+{
+    DeepCallArgs *args = (DeepCallArgs *) argsp;
+    volatile char buf[1024];
+    memset((char *) buf, args->depth, sizeof buf);
+    if (args->depth > 0) {
+        DeepCallArgs next = *args;
+        --next.depth;
+        deep_call(&next);
+    } else if (!args->nested) {
+        /* has to run on a different stack */
+        DeepCallArgs inner;
+        inner.depth = 16;
+        inner.nested = true;
+        require(fiber_call_with_stack(32 * 1024, deep_call, &inner));
+    }
+    require(buf[0] == (char) args->depth);
+}
+
+typedef struct
+{
+    Fiber *self;
+    Fiber *caller;
+    bool done;
+} TrimArgs;
+
+static void
+dirty_stack(int depth)
+{
+    volatile char buf[1024];
+    memset((char *) buf, depth, sizeof buf);
+    if (depth > 0)
+        dirty_stack(depth - 1);
+    require(buf[0] == (char) depth);
+}
+
+static void
+trim_entry(void *argsp)
+{
+    TrimArgs *args = (TrimArgs *) argsp;
+    char live[2048];
+    for (size_t i = 0; i < sizeof live; ++i)
+        live[i] = (char) i;
+    /* leave dirty pages below the live frames */
+    dirty_stack(8);
+    fiber_switch(args->self, args->caller);
+    for (size_t i = 0; i < sizeof live; ++i)
+        require(live[i] == (char) i);
+    args->done = true;
+    fiber_switch(args->self, args->caller);
+}
+
+static void
+test_trim(Fiber *toplevel)
+{
+    Fiber fiber;
+    require(fiber_alloc(
+      &fiber, 2 * STACK_SIZE, fiber_cleanup, NULL, FIBER_FLAG_GUARD_LO));
+    TrimArgs *args;
+    fiber_reserve_return(&fiber, trim_entry, (void **) &args, sizeof *args);
+    args->self = &fiber;
+    args->caller = toplevel;
+    args->done = false;
+    fiber_switch(toplevel, &fiber);
+    require(fiber_trim_stack(&fiber));
+    fiber_switch(toplevel, &fiber);
+    require(args->done);
+    fiber_destroy(&fiber);
+}
+
+typedef struct
+{
+    Fiber *self;
+    Fiber *caller;
+    int pushed;
+} ParkArgs;
+
+static void
+park(void *argsp)
+{
+    ParkArgs *args = (ParkArgs *) argsp;
+    fiber_switch(args->self, args->caller);
+}
+
+static void
+park_entry(void *argsp)
+{
+    ParkArgs *args = (ParkArgs *) argsp;
+    require(fiber_call_with_stack(1024 * 1024, park, args));
+    require(args->pushed == 1);
+    fiber_switch(args->self, args->caller);
+}
+
+static void
+mark_pushed(void *argsp)
+{
+    ++**(int **) argsp;
+}
+
+/* a fiber suspended on a fiber_call_with_stack() stack */
+static void
+test_park_on_call_stack(Fiber *toplevel)
+{
+    Fiber fiber;
+    require(fiber_alloc(&fiber,
+                        STACK_SIZE,
+                        fiber_cleanup,
+                        NULL,
+                        FIBER_FLAG_GUARD_LO | FIBER_FLAG_GUARD_CANARY));
+    ParkArgs *args;
+    fiber_reserve_return(&fiber, park_entry, (void **) &args, sizeof *args);
+    args->self = &fiber;
+    args->caller = toplevel;
+    args->pushed = 0;
+    fiber_switch(toplevel, &fiber);
+
+    require(fiber_stack_free_size(&fiber) == 0);
+    require(fiber_trim_stack(&fiber));
+    FiberSnapshot snap;
+    require(!fiber_snapshot(&fiber, &snap));
+    int *pushed = &args->pushed;
+    fiber_push_return(&fiber, mark_pushed, &pushed, sizeof pushed);
+    fiber_switch(toplevel, &fiber);
+    require(args->pushed == 1);
+
+    fiber_destroy(&fiber);
+    fiber_release_call_stacks();
+    require(!fiber_call_with_stack((size_t) -1, park, NULL));
+}
+
+typedef struct
+{
+    Fiber *self;
+    Fiber *caller;
+    int *value;
+} CounterArgs;
+
+static void
+counter_entry(void *argsp)
+{
+    CounterArgs *args = (CounterArgs *) argsp;
+    int n = 0;
+    for (;;) {
+        *args->value = ++n;
+        fiber_switch(args->self, args->caller);
+    }
+}
+
+/* a canary-guarded stack which is too small has to be rejected, not abort */
+static void
+test_canary_min_size(void)
+{
+    bool ok = false;
+    for (size_t size = 0; size <= 512; ++size) {
+        Fiber fiber;
+        bool alloced = fiber_alloc(
+          &fiber, size, fiber_cleanup, NULL, FIBER_FLAG_GUARD_CANARY);
+        /* sizes just below the minimum fail, every size above succeeds */
+        require(alloced || !ok);
+        ok = alloced;
+        if (alloced)
+            fiber_destroy(&fiber);
+    }
+    require(ok);
+}
+
+static void
+test_snapshot(Fiber *toplevel)
+{
+    Fiber fiber;
+    require(fiber_alloc(
+      &fiber, STACK_SIZE, fiber_cleanup, NULL, FIBER_FLAG_GUARD_LO));
+    int value = 0;
+    CounterArgs args;
+    args.self = &fiber;
+    args.caller = toplevel;
+    args.value = &value;
+    fiber_push_return(&fiber, counter_entry, &args, sizeof args);
+
+    fiber_switch(toplevel, &fiber);
+    require(value == 1);
+    FiberSnapshot snap;
+    require(fiber_snapshot(&fiber, &snap));
+    fiber_switch(toplevel, &fiber);
+    fiber_switch(toplevel, &fiber);
+    require(value == 3);
+
+    /* resume from the snapshot, twice */
+    fiber_restore(&fiber, &snap);
+    fiber_switch(toplevel, &fiber);
+    require(value == 2);
+    fiber_restore(&fiber, &snap);
+    fiber_switch(toplevel, &fiber);
+    require(value == 2);
+    fiber_switch(toplevel, &fiber);
+    require(value == 3);
+
+    fiber_snapshot_free(&snap);
+    fiber_destroy(&fiber);
+}
+
 static void
 fiber_entry(void *argsp)
 {
     FiberArgs *args = (FiberArgs *) argsp;
     println("fiber_entry()");
+    /* the arena buffer was reserved together with the arguments */
+    test_arena(args + 1);
+    /* far more than the 16kb of the fiber stack */
+    DeepCallArgs deep;
+    deep.depth = 100;
+    deep.nested = false;
+    require(fiber_call_with_stack(256 * 1024, deep_call, &deep));
     fiber_switch(args->self, args->caller);
 
     put_str(args->self, args->caller, "some string");
@@ -65,16 +302,32 @@ main(int argc, char *argv[])
                        NULL,
                        FIBER_FLAG_GUARD_LO | FIBER_FLAG_GUARD_HI);
     FiberArgs *args;
-    fiber_reserve_return(&fiber, fiber_entry, (void **) &args, sizeof *args);
+    fiber_reserve_return(
+      &fiber, fiber_entry, (void **) &args, sizeof *args + ARENA_SIZE);
     args->self = &fiber;
     args->caller = &toplevel;
     fiber_switch(&toplevel, &fiber);
     require(fiber_stack_used_size(&fiber) < 1024);
     require(fiber_stack_free_size(&fiber) > STACK_SIZE - 1024);
     require(fiber_stack_free_size(&fiber) < STACK_SIZE);
+    require(fiber_trim_stack(&fiber));
+    FiberStats stats;
+    if (fiber_stats(&stats)) {
+        require(stats.live_fibers == 1);
+        /* two for the fiber, one for each cached fiber_call_with_stack()
+         * stack */
+        require(stats.guard_pages == 4);
+        require(stats.thread_switches == 2);
+        require(stats.switches == 2);
+    }
     println("in main()");
     fiber_switch(&toplevel, &fiber);
     fiber_destroy(&fiber);
+    fiber_release_call_stacks();
+    test_trim(&toplevel);
+    test_park_on_call_stack(&toplevel);
+    test_canary_min_size();
+    test_snapshot(&toplevel);
 
     test_main_end();
     return 0;
@@ -2,10 +2,12 @@
 
 #include "test_pre.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define STACK_SIZE ((size_t) 16 * 1024)
+#define ARENA_SIZE ((size_t) 256)
 
 typedef struct Thread Thread;
 
@@ -16,7 +18,9 @@ struct Thread
     Sched *sched;
     Thread *prev, *next;
     Fiber fiber;
+    FiberArena arena;
     int id;
+    bool cancelled;
 };
 
 struct Sched
@@ -24,6 +28,7 @@ struct Sched
     Thread main_thread;
     Thread *running;
     Thread *done; /* only next ptr used */
+    FiberPool pool;
     size_t fuel;
     int next_id;
     bool shutdown_signal;
@@ -38,7 +43,7 @@ typedef struct
 typedef struct
 {
     Thread *thread;
-} CleanupArgs;
+} CancelArgs;
 
 static Thread *the_thread;
 
@@ -55,7 +60,7 @@ thread_fiber(Thread *th)
 }
 
 static void
-thread_switch(Thread *from, Thread *to)
+thread_set_running(Thread *from, Thread *to)
 {
     Sched *sched = from->sched;
     require(sched->running == from);
@@ -66,13 +71,21 @@ thread_switch(Thread *from, Thread *to)
 
     sched->running = to;
     the_thread = to;
-    fiber_switch(thread_fiber(from), thread_fiber(to));
 }
 
 static void
+thread_switch(Thread *from, Thread *to)
+{
+    thread_set_running(from, to);
+    fiber_switch(thread_fiber(from), thread_fiber(to));
+}
+
+/* returns ECANCELED if the thread was cancelled while it was suspended */
+static int
 yield(void)
 {
     thread_switch(the_thread, the_thread->next);
+    return the_thread->cancelled ? ECANCELED : 0;
 }
 
 static void
@@ -84,12 +97,32 @@ thread_exec(void *args0)
 }
 
 static void
-thread_cleanup_cont(void *args0)
+thread_release(Fiber *fiber, void *arg)
 {
-    CleanupArgs *args = (CleanupArgs *) args0;
-    fprintf(out, "[Scheduler] thread exited: %d\n", args->thread->id);
-    fiber_destroy(&args->thread->fiber);
-    free(args->thread);
+    Thread *th = (Thread *) arg;
+    fprintf(out, "[Scheduler] thread exited: %d\n", th->id);
+    /* the arena is not tied to the fiber, it has to be reset on exit */
+    fiber_arena_reset(&th->arena);
+    fiber_pool_release(&th->sched->pool, fiber);
+    free(th);
+}
+
+static void
+thread_cancel_cont(void *args0)
+{
+    /* runs on the stack of the cancelled thread, right before its pending
+     * yield() returns */
+    CancelArgs *args = (CancelArgs *) args0;
+    args->thread->cancelled = true;
+}
+
+static void
+thread_cancel(Thread *th)
+{
+    require(th != the_thread);
+    CancelArgs args;
+    args.thread = th;
+    fiber_push_return(&th->fiber, thread_cancel_cont, &args, sizeof args);
 }
 
 static void
@@ -101,21 +134,12 @@ thread_guard(Fiber *self, void *arg)
     require(self == &th->fiber);
     (void) self;
 
-    Sched *sched = th->sched;
-    Thread *sched_thread = &sched->main_thread;
-    CleanupArgs *args;
-
-    fiber_reserve_return(
-      &sched_thread->fiber, thread_cleanup_cont, (void **) &args, sizeof args);
-    args->thread = th;
-
     Thread *next = th->next;
     // unlink ourself
     th->prev->next = th->next;
     th->next->prev = th->prev;
-    thread_switch(th, next);
-    // does not return here
-    abort();
+    thread_set_running(th, next);
+    fiber_switch_release(&th->fiber, thread_fiber(next), thread_release, th);
 }
 
 static void
@@ -124,13 +148,17 @@ thread_start(Sched *sched, void (*func)(void))
     Thread *th = hu_cxx_static_cast(Thread *, malloc(sizeof *th));
     th->sched = sched;
     th->id = sched->next_id++;
-    (void) fiber_alloc(
-      &th->fiber, STACK_SIZE, thread_guard, th, FIBER_FLAG_GUARD_LO);
+    th->cancelled = false;
+    (void) fiber_pool_alloc(&sched->pool, &th->fiber, thread_guard, th);
 
-    ThreadArgs args;
-    args.thread = th;
-    args.entry = func;
-    fiber_push_return(&th->fiber, thread_exec, &args, sizeof args);
+    /* the initial block of the arena lives next to the arguments at the
+     * top of the stack */
+    ThreadArgs *args;
+    fiber_reserve_return(
+      &th->fiber, thread_exec, (void **) &args, sizeof *args + ARENA_SIZE);
+    args->thread = th;
+    args->entry = func;
+    fiber_arena_init(&th->arena, args + 1, ARENA_SIZE, 1024);
 
     th->next = sched->running->next;
     th->prev = sched->running;
@@ -144,10 +172,12 @@ sched_init(Sched *s)
     s->main_thread.prev = &s->main_thread;
     s->main_thread.next = &s->main_thread;
     s->main_thread.sched = s;
+    s->main_thread.cancelled = false;
     fiber_init_toplevel(&s->main_thread.fiber);
 
     s->running = &s->main_thread;
     s->done = 0;
+    fiber_pool_init(&s->pool, STACK_SIZE, FIBER_FLAG_GUARD_LO, 4);
     s->next_id = 1;
     s->shutdown_signal = false;
 }
@@ -185,11 +215,19 @@ worker(void)
     int work = 13 + ((my_id * 17) % 11);
     unsigned h = 42;
     fprintf(out, "[Worker %d] started, work=%d\n", my_id, work);
-    while (!shutting_down() && work-- > 0) {
+    while (work-- > 0) {
+        /* keep the intermediate results, overflows the initial block */
+        unsigned *step = hu_cxx_static_cast(
+          unsigned *, fiber_arena_alloc(&the_thread->arena, 4 * sizeof h));
+        require(step);
+        step[0] = h;
         h ^= (unsigned) work;
         h = (h << 13) | (h >> 19);
         h *= 1337;
-        yield();
+        if (yield() == ECANCELED) {
+            fprintf(out, "[Worker %d] cancelled\n", my_id);
+            break;
+        }
     }
     fprintf(out, "[Worker %d] exiting, result: %u\n", my_id, h);
 }
@@ -265,6 +303,10 @@ execute(Sched *sched)
         if (sched->fuel == 0 && !sched->shutdown_signal) {
             sched->shutdown_signal = true;
             println("[Scheduler] sending shutdown signal");
+            for (Thread *th = sched->main_thread.next;
+                 th != &sched->main_thread;
+                 th = th->next)
+                thread_cancel(th);
         }
     }
 
@@ -285,6 +327,7 @@ main(int argc, char *argv[])
     thread_start(&s, thread3);
 
     execute(&s);
+    fiber_pool_destroy(&s.pool);
 
     test_main_end();
     return 0;
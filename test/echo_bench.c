@@ -0,0 +1,577 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fiber/fiber.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Echo server macrobenchmark: pairs of client and server fibers talk over
+ * local socketpairs, every client measures the round trip latency of its
+ * requests. Each OS thread runs a minimal poll() based scheduler. With -B
+ * every connection is served by a pair of OS threads doing blocking IO
+ * instead, as a baseline. With -q the fiber schedulers additionally record
+ * the run queue delay, the time between a fiber becoming ready and the
+ * switch to it.
+ */
+
+#define MAX_MSG_SIZE 4096
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB ((uint64_t) 1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} Histogram;
+
+typedef struct
+{
+    size_t conns;
+    size_t threads;
+    size_t stack_size;
+    size_t requests;
+    size_t msg_size;
+    bool baseline;
+    bool queue_delay;
+} Config;
+
+typedef struct Task Task;
+typedef struct Worker Worker;
+
+struct Task
+{
+    Fiber fiber;
+    Worker *worker;
+    Task *next;
+    uint64_t ready_ns;
+    int fd;
+    bool is_client;
+    char buf[MAX_MSG_SIZE];
+};
+
+struct Worker
+{
+    Fiber toplevel;
+    const Config *config;
+    FiberPool pool;
+    Task *ready_head, *ready_tail;
+    Task **waiting;
+    struct pollfd *pfds;
+    size_t num_waiting;
+    size_t num_live;
+    int *fds;
+    size_t num_conns;
+    Histogram hist;
+    Histogram queue_hist;
+    pthread_t thread;
+};
+
+typedef struct
+{
+    int fd;
+    bool is_client;
+    const Config *config;
+    Histogram *hist;
+    pthread_mutex_t *hist_mutex;
+    char buf[MAX_MSG_SIZE];
+} ThreadConn;
+
+#define die(msg)                                                               \
+    do {                                                                       \
+        perror(msg);                                                           \
+        exit(1);                                                               \
+    } while (0)
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static size_t
+hist_bucket(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return (size_t) v;
+    unsigned shift = 0;
+    while ((v >> shift) >= 2 * HIST_SUB)
+        ++shift;
+    return (size_t) (((uint64_t) (shift + 1) << HIST_SUB_BITS) |
+                     ((v >> shift) & (HIST_SUB - 1)));
+}
+
+static uint64_t
+hist_bucket_value(size_t b)
+{
+    if (b < HIST_SUB)
+        return b;
+    unsigned shift = (unsigned) (b >> HIST_SUB_BITS) - 1;
+    return (HIST_SUB | (b & (HIST_SUB - 1))) << shift;
+}
+
+static void
+hist_record(Histogram *h, uint64_t v)
+{
+    ++h->counts[hist_bucket(v)];
+    ++h->total;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void
+hist_merge(Histogram *dst, const Histogram *src)
+{
+    for (size_t i = 0; i < HIST_BUCKETS; ++i)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static uint64_t
+hist_percentile(const Histogram *h, double p)
+{
+    uint64_t rank = (uint64_t) (p * (double) h->total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return hist_bucket_value(i);
+    }
+    return h->max;
+}
+
+static void
+set_nonblocking(int fd)
+{
+    int fl = fcntl(fd, F_GETFL);
+    if (fl < 0 || fcntl(fd, F_SETFL, fl | O_NONBLOCK) < 0)
+        die("fcntl");
+}
+
+/* fiber scheduler */
+
+static void
+task_ready(Worker *w, Task *t)
+{
+    if (w->config->queue_delay)
+        t->ready_ns = now_ns();
+    t->next = NULL;
+    if (w->ready_tail)
+        w->ready_tail->next = t;
+    else
+        w->ready_head = t;
+    w->ready_tail = t;
+}
+
+static void
+task_wait_fd(Task *t, short events)
+{
+    Worker *w = t->worker;
+    w->waiting[w->num_waiting] = t;
+    w->pfds[w->num_waiting].fd = t->fd;
+    w->pfds[w->num_waiting].events = events;
+    w->pfds[w->num_waiting].revents = 0;
+    ++w->num_waiting;
+    fiber_switch(&t->fiber, &w->toplevel);
+}
+
+static bool
+task_io(Task *t, char *buf, size_t n, bool wr)
+{
+    while (n > 0) {
+        ssize_t r = wr ? write(t->fd, buf, n) : read(t->fd, buf, n);
+        if (r > 0) {
+            buf += r;
+            n -= (size_t) r;
+        } else if (r == 0) {
+            return false;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            task_wait_fd(t, wr ? POLLOUT : POLLIN);
+        } else if (errno != EINTR) {
+            die(wr ? "write" : "read");
+        }
+    }
+    return true;
+}
+
+static void
+task_run(void *arg)
+{
+    Task *t = *(Task **) arg;
+    Worker *w = t->worker;
+    size_t msg_size = w->config->msg_size;
+    if (t->is_client) {
+        memset(t->buf, 'x', msg_size);
+        for (size_t i = 0; i < w->config->requests; ++i) {
+            uint64_t t0 = now_ns();
+            if (!task_io(t, t->buf, msg_size, true) ||
+                !task_io(t, t->buf, msg_size, false))
+                break;
+            hist_record(&w->hist, now_ns() - t0);
+        }
+    } else {
+        while (task_io(t, t->buf, msg_size, false))
+            if (!task_io(t, t->buf, msg_size, true))
+                break;
+    }
+    close(t->fd);
+    t->fd = -1;
+    --w->num_live;
+    fiber_switch(&t->fiber, &w->toplevel);
+    abort();
+}
+
+static void
+task_guard(Fiber *self, void *arg)
+{
+    (void) self;
+    (void) arg;
+    abort();
+}
+
+static void
+task_spawn(Worker *w, int fd, bool is_client)
+{
+    Task *t = (Task *) malloc(sizeof *t);
+    if (!t || !fiber_pool_alloc(&w->pool, &t->fiber, task_guard, NULL))
+        die("task_spawn");
+    t->worker = w;
+    t->fd = fd;
+    t->is_client = is_client;
+    set_nonblocking(fd);
+    fiber_push_return(&t->fiber, task_run, &t, sizeof t);
+    task_ready(w, t);
+    ++w->num_live;
+}
+
+static void
+worker_poll(Worker *w)
+{
+    if (poll(w->pfds, (nfds_t) w->num_waiting, -1) < 0) {
+        if (errno == EINTR)
+            return;
+        die("poll");
+    }
+    size_t j = 0;
+    for (size_t i = 0; i < w->num_waiting; ++i) {
+        if (w->pfds[i].revents) {
+            task_ready(w, w->waiting[i]);
+        } else {
+            w->waiting[j] = w->waiting[i];
+            w->pfds[j] = w->pfds[i];
+            ++j;
+        }
+    }
+    w->num_waiting = j;
+}
+
+static void *
+worker_main(void *arg)
+{
+    Worker *w = (Worker *) arg;
+    fiber_init_toplevel(&w->toplevel);
+    for (size_t i = 0; i < w->num_conns; ++i) {
+        task_spawn(w, w->fds[2 * i], false);
+        task_spawn(w, w->fds[2 * i + 1], true);
+    }
+
+    while (w->num_live > 0 || w->ready_head) {
+        while (w->ready_head) {
+            Task *t = w->ready_head;
+            w->ready_head = t->next;
+            if (!w->ready_head)
+                w->ready_tail = NULL;
+            if (w->config->queue_delay)
+                hist_record(&w->queue_hist, now_ns() - t->ready_ns);
+            fiber_switch(&w->toplevel, &t->fiber);
+            if (t->fd < 0) {
+                fiber_pool_release(&w->pool, &t->fiber);
+                free(t);
+            }
+        }
+        if (w->num_waiting > 0)
+            worker_poll(w);
+    }
+    return NULL;
+}
+
+/* thread per connection baseline */
+
+static void *
+conn_thread(void *arg)
+{
+    ThreadConn *c = (ThreadConn *) arg;
+    size_t msg_size = c->config->msg_size;
+    Histogram *hist = NULL;
+    if (c->is_client) {
+        hist = (Histogram *) calloc(1, sizeof *hist);
+        if (!hist)
+            die("calloc");
+    }
+
+    for (size_t i = 0;; ++i) {
+        if (c->is_client && i == c->config->requests)
+            break;
+        uint64_t t0 = now_ns();
+        bool ok = true;
+        for (int step = 0; ok && step < 2; ++step) {
+            bool wr = c->is_client ? step == 0 : step == 1;
+            size_t n = msg_size;
+            char *p = c->buf;
+            while (n > 0) {
+                ssize_t r = wr ? write(c->fd, p, n) : read(c->fd, p, n);
+                if (r > 0) {
+                    p += r;
+                    n -= (size_t) r;
+                } else if (r == 0) {
+                    ok = false;
+                    break;
+                } else if (errno != EINTR) {
+                    die(wr ? "write" : "read");
+                }
+            }
+        }
+        if (!ok)
+            break;
+        if (hist)
+            hist_record(hist, now_ns() - t0);
+    }
+    close(c->fd);
+
+    if (hist) {
+        pthread_mutex_lock(c->hist_mutex);
+        hist_merge(c->hist, hist);
+        pthread_mutex_unlock(c->hist_mutex);
+        free(hist);
+    }
+    return NULL;
+}
+
+static void
+run_baseline(const Config *cfg, int *fds, Histogram *hist)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    size_t n = 2 * cfg->conns;
+    ThreadConn *conns = (ThreadConn *) calloc(n, sizeof *conns);
+    pthread_t *threads = (pthread_t *) calloc(n, sizeof *threads);
+    if (!conns || !threads)
+        die("calloc");
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (pthread_attr_setstacksize(&attr, cfg->stack_size) != 0)
+        pthread_attr_setstacksize(&attr, 64 * 1024);
+
+    for (size_t i = 0; i < n; ++i) {
+        conns[i].fd = fds[i];
+        conns[i].is_client = (i & 1) != 0;
+        conns[i].config = cfg;
+        conns[i].hist = hist;
+        conns[i].hist_mutex = &mutex;
+        if (pthread_create(&threads[i], &attr, conn_thread, &conns[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < n; ++i)
+        pthread_join(threads[i], NULL);
+
+    pthread_attr_destroy(&attr);
+    free(threads);
+    free(conns);
+}
+
+static void
+run_fibers(const Config *cfg,
+           int *fds,
+           Histogram *hist,
+           Histogram *queue_hist)
+{
+    Worker *workers = (Worker *) calloc(cfg->threads, sizeof *workers);
+    if (!workers)
+        die("calloc");
+
+    size_t conn = 0;
+    for (size_t i = 0; i < cfg->threads; ++i) {
+        Worker *w = &workers[i];
+        size_t n = cfg->conns / cfg->threads;
+        if (i < cfg->conns % cfg->threads)
+            ++n;
+        w->config = cfg;
+        w->fds = fds + 2 * conn;
+        w->num_conns = n;
+        conn += n;
+        w->waiting = (Task **) calloc(2 * n + 1, sizeof *w->waiting);
+        w->pfds = (struct pollfd *) calloc(2 * n + 1, sizeof *w->pfds);
+        if (!w->waiting || !w->pfds)
+            die("calloc");
+        fiber_pool_init(&w->pool, cfg->stack_size, FIBER_FLAG_GUARD_LO, 64);
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(1);
+        }
+    }
+
+    for (size_t i = 0; i < cfg->threads; ++i) {
+        Worker *w = &workers[i];
+        pthread_join(w->thread, NULL);
+        hist_merge(hist, &w->hist);
+        hist_merge(queue_hist, &w->queue_hist);
+        fiber_pool_destroy(&w->pool);
+        free(w->waiting);
+        free(w->pfds);
+    }
+    free(workers);
+}
+
+static void
+run_config(const Config *cfg)
+{
+    int *fds = (int *) calloc(2 * cfg->conns, sizeof *fds);
+    Histogram *hist = (Histogram *) calloc(1, sizeof *hist);
+    Histogram *queue_hist = (Histogram *) calloc(1, sizeof *queue_hist);
+    if (!fds || !hist || !queue_hist)
+        die("calloc");
+    for (size_t i = 0; i < cfg->conns; ++i)
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds + 2 * i) != 0)
+            die("socketpair");
+
+    uint64_t t0 = now_ns();
+    if (cfg->baseline)
+        run_baseline(cfg, fds, hist);
+    else
+        run_fibers(cfg, fds, hist, queue_hist);
+    double secs = (double) (now_ns() - t0) * 1e-9;
+
+    printf("%-7s threads=%-3zu conns=%-6zu stack=%-7zu msg=%-5zu "
+           "rps=%-10.0f p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+           cfg->baseline ? "threads" : "fibers",
+           cfg->baseline ? 2 * cfg->conns : cfg->threads,
+           cfg->conns,
+           cfg->stack_size,
+           cfg->msg_size,
+           (double) hist->total / secs,
+           (double) hist_percentile(hist, 0.5) * 1e-3,
+           (double) hist_percentile(hist, 0.99) * 1e-3,
+           (double) hist_percentile(hist, 0.999) * 1e-3,
+           (double) hist->max * 1e-3);
+    if (queue_hist->total > 0)
+        printf("        queue delay: switches=%-10llu "
+               "p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+               (unsigned long long) queue_hist->total,
+               (double) hist_percentile(queue_hist, 0.5) * 1e-3,
+               (double) hist_percentile(queue_hist, 0.99) * 1e-3,
+               (double) hist_percentile(queue_hist, 0.999) * 1e-3,
+               (double) queue_hist->max * 1e-3);
+    fflush(stdout);
+
+    free(queue_hist);
+    free(hist);
+    free(fds);
+}
+
+static void
+raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-c conns] [-t threads] [-s stack_size] "
+            "[-n requests] [-m msg_size] [-B] [-q]\n"
+            "without arguments a default set of configurations is run\n",
+            prog);
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    raise_fd_limit();
+
+    Config cfg;
+    cfg.conns = 1000;
+    cfg.threads = 1;
+    cfg.stack_size = 16 * 1024;
+    cfg.requests = 200;
+    cfg.msg_size = 64;
+    cfg.baseline = false;
+    cfg.queue_delay = false;
+
+    if (argc == 1) {
+        static const size_t conns[] = { 10, 100, 1000, 4000 };
+        static const size_t stacks[] = { 16 * 1024, 64 * 1024 };
+        for (size_t i = 0; i < sizeof conns / sizeof conns[0]; ++i) {
+            cfg.conns = conns[i];
+            for (size_t j = 0; j < sizeof stacks / sizeof stacks[0]; ++j) {
+                cfg.stack_size = stacks[j];
+                cfg.baseline = false;
+                cfg.threads = 1;
+                run_config(&cfg);
+                cfg.threads = 4;
+                run_config(&cfg);
+                cfg.baseline = true;
+                run_config(&cfg);
+            }
+        }
+        return 0;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:t:s:n:m:Bq")) != -1) {
+        switch (opt) {
+        case 'c':
+            cfg.conns = (size_t) strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            cfg.threads = (size_t) strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            cfg.stack_size = (size_t) strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            cfg.requests = (size_t) strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            cfg.msg_size = (size_t) strtoul(optarg, NULL, 0);
+            break;
+        case 'B':
+            cfg.baseline = true;
+            break;
+        case 'q':
+            cfg.queue_delay = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (cfg.conns == 0 || cfg.threads == 0 || cfg.msg_size == 0 ||
+        cfg.msg_size > MAX_MSG_SIZE)
+        usage(argv[0]);
+    run_config(&cfg);
+    return 0;
+}
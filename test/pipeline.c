@@ -0,0 +1,255 @@
+#define __STDC_FORMAT_MACROS 1
+#define _POSIX_C_SOURCE 200809L
+
+#include <fiber/fiber.h>
+
+#include "test_pre.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if HU_OS_POSIX_P
+#    include <signal.h>
+#    include <sys/resource.h>
+#    include <sys/wait.h>
+#    include <unistd.h>
+#endif
+
+#define STACK_SIZE ((size_t) 16 * 1024)
+
+/*
+ * Pipeline stages which hand over their output in chunks: a producer fills
+ * its chunk buffer and only switches to its consumer once the buffer is full
+ * (or the producer is done). The consumer then processes the whole chunk in a
+ * tight loop. A producer cannot run ahead of its consumer by more than one
+ * chunk, so the chunk buffers provide the backpressure. Optionally a stage
+ * also flushes once it spent its time budget on the current chunk, which
+ * bounds the latency of slow producers.
+ */
+
+typedef struct Stage Stage;
+
+typedef void (*StageFunc)(Stage *);
+
+struct Stage
+{
+    Fiber fiber;
+    Fiber *consumer;
+    Stage *source;
+    StageFunc run;
+    uint64_t *chunk;
+    size_t chunk_cap;
+    size_t chunk_len;
+    size_t num_chunks;
+    uint64_t param;
+    /* flush after budget ticks of clock(), if timed */
+    clock_t budget;
+    clock_t chunk_start;
+    bool timed;
+    bool done;
+};
+
+static void
+fiber_guard(Fiber *self, void *null)
+{
+    (void) null;
+    fprintf(stderr, "fiber_guard(fiber=%p) called, aborting\n", self);
+    abort();
+}
+
+static void
+stage_flush(Stage *st)
+{
+    ++st->num_chunks;
+    fiber_switch(&st->fiber, st->consumer);
+    /* the consumer is done with the chunk */
+    st->chunk_len = 0;
+}
+
+static void
+stage_emit(Stage *st, uint64_t v)
+{
+    if (st->timed && st->chunk_len == 0)
+        st->chunk_start = clock();
+    st->chunk[st->chunk_len++] = v;
+    if (st->chunk_len == st->chunk_cap ||
+        (st->timed && clock() - st->chunk_start >= st->budget))
+        stage_flush(st);
+}
+
+static void
+stage_set_budget(Stage *st, clock_t budget)
+{
+    for (; st; st = st->source) {
+        st->timed = true;
+        st->budget = budget;
+    }
+}
+
+/* switch to src until it produced the next chunk, returns its length, 0 if
+ * src is exhausted */
+static size_t
+stage_pull(Stage *src, Fiber *self, const uint64_t **items)
+{
+    if (src->done)
+        return 0;
+    src->consumer = self;
+    fiber_switch(self, &src->fiber);
+    *items = src->chunk;
+    return src->chunk_len;
+}
+
+static void
+stage_start(void *args0)
+{
+    Stage *st = *(Stage **) args0;
+    st->run(st);
+    st->done = true;
+    stage_flush(st);
+    // noreturn
+    abort();
+}
+
+static Stage *
+stage_new(StageFunc run, Stage *source, size_t chunk_cap, uint64_t param)
+{
+    Stage *st = hu_cxx_static_cast(Stage *, calloc(1, sizeof *st));
+    require(st);
+    st->run = run;
+    st->source = source;
+    st->chunk_cap = chunk_cap;
+    st->chunk = hu_cxx_static_cast(uint64_t *,
+                                   calloc(chunk_cap, sizeof *st->chunk));
+    st->param = param;
+    require(st->chunk);
+    require(fiber_alloc(
+      &st->fiber, STACK_SIZE, fiber_guard, NULL, FIBER_FLAG_GUARD_CANARY));
+    fiber_push_return(&st->fiber, stage_start, &st, sizeof st);
+    return st;
+}
+
+static size_t
+stage_free(Stage *st)
+{
+    size_t chunks = 0;
+    if (st->source)
+        chunks += stage_free(st->source);
+    require(st->done);
+    chunks += st->num_chunks;
+    fiber_destroy(&st->fiber);
+    free(st->chunk);
+    free(st);
+    return chunks;
+}
+
+static void
+range_stage(Stage *self)
+{
+    for (uint64_t i = 0; i < self->param; ++i)
+        stage_emit(self, i);
+}
+
+static void
+filter_odd_stage(Stage *self)
+{
+    const uint64_t *items;
+    size_t n;
+    while ((n = stage_pull(self->source, &self->fiber, &items)) > 0)
+        for (size_t i = 0; i < n; ++i)
+            if (items[i] & 1)
+                stage_emit(self, items[i]);
+}
+
+static void
+square_stage(Stage *self)
+{
+    const uint64_t *items;
+    size_t n;
+    while ((n = stage_pull(self->source, &self->fiber, &items)) > 0)
+        for (size_t i = 0; i < n; ++i)
+            stage_emit(self, items[i] * items[i]);
+}
+
+/* returns the number of chunks handed over, budget < 0 disables the time
+ * budget */
+static size_t
+run_pipeline(Fiber *toplevel, size_t chunk_size, double budget_secs)
+{
+    Stage *range = stage_new(range_stage, NULL, chunk_size, 10000);
+    Stage *odd = stage_new(filter_odd_stage, range, chunk_size, 0);
+    Stage *sq = stage_new(square_stage, odd, chunk_size, 0);
+    if (budget_secs >= 0)
+        stage_set_budget(sq, (clock_t) (budget_secs * CLOCKS_PER_SEC));
+
+    uint64_t sum = 0;
+    uint64_t count = 0;
+    const uint64_t *items;
+    size_t n;
+    while ((n = stage_pull(sq, toplevel, &items)) > 0) {
+        for (size_t i = 0; i < n; ++i)
+            sum += items[i];
+        count += n;
+    }
+
+    size_t chunks = stage_free(sq);
+    fprintf(out,
+            "[Main] chunk_size=%zu items=%" PRIu64 " sum=%" PRIu64
+            " chunks=%zu",
+            chunk_size,
+            count,
+            sum,
+            chunks);
+    if (budget_secs >= 0)
+        fprintf(out, " budget=%gs", budget_secs);
+    fprintf(out, "\n");
+    return chunks;
+}
+
+#if HU_OS_POSIX_P
+/* a stage which overwrote its canary has to be caught on its next switch */
+static void
+test_canary_overwrite(Fiber *toplevel)
+{
+    fflush(out);
+    pid_t pid = fork();
+    require(pid >= 0);
+    if (pid == 0) {
+        struct rlimit no_core = { 0, 0 };
+        (void) setrlimit(RLIMIT_CORE, &no_core);
+        /* silence the expected error message */
+        require(freopen("/dev/null", "w", stderr));
+        Stage *st = stage_new(range_stage, NULL, 1, 10);
+        memset(st->fiber.stack, 0, sizeof(void *));
+        const uint64_t *items;
+        (void) stage_pull(st, toplevel, &items);
+        _exit(0);
+    }
+    int status;
+    require(waitpid(pid, &status, 0) == pid);
+    require(WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT);
+}
+#endif
+
+int
+main(int argc, char *argv[])
+{
+    test_main_begin(&argc, &argv);
+    Fiber toplevel;
+    fiber_init_toplevel(&toplevel);
+    size_t unbuffered = run_pipeline(&toplevel, 1, -1);
+    run_pipeline(&toplevel, 16, -1);
+    size_t sized = run_pipeline(&toplevel, 256, -1);
+    run_pipeline(&toplevel, 10000, -1);
+    /* an exhausted budget flushes every item, an ample one never triggers */
+    require(run_pipeline(&toplevel, 256, 0) == unbuffered);
+    require(run_pipeline(&toplevel, 256, 60) == sized);
+#if HU_OS_POSIX_P
+    test_canary_overwrite(&toplevel);
+#endif
+    test_main_end();
+    return 0;
+}